@@ -0,0 +1,283 @@
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+/**
+ * Memory mapped submission and completion queue of an io_uring instance
+ */
+struct LinkBatch::Ring {
+    ~Ring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqPtr != MAP_FAILED && cqPtr != sqPtr) {
+            munmap(cqPtr, cqSize);
+        }
+        if (sqPtr != MAP_FAILED) {
+            munmap(sqPtr, sqSize);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned toSubmit = 0;
+
+    void *sqPtr = MAP_FAILED;
+    std::size_t sqSize = 0;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    std::size_t sqesSize = 0;
+
+    void *cqPtr = MAP_FAILED;
+    std::size_t cqSize = 0;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+};
+
+namespace {
+
+template <typename T> T *ringField(void *ring, __u32 offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+}
+
+/**
+ * Create an io_uring instance that may only be used for symlinkat and
+ * unlinkat (so it can't be used to bypass the seccomp filter).
+ * @return The ring or nullptr if io_uring (or one of the operations) is not
+ * supported
+ */
+template <typename Ring> std::unique_ptr<Ring> setupRing(unsigned entries) {
+    auto ring = std::make_unique<Ring>();
+
+    io_uring_params params{};
+    params.flags = IORING_SETUP_R_DISABLED;
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return nullptr;
+    }
+    ring->entries = params.sq_entries;
+
+    const __u8 opcodes[] = {IORING_OP_SYMLINKAT, IORING_OP_UNLINKAT};
+    std::vector<char> probeBuf(sizeof(io_uring_probe) +
+                               256 * sizeof(io_uring_probe_op));
+    auto probe = reinterpret_cast<io_uring_probe *>(probeBuf.data());
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe,
+                256) != 0) {
+        return nullptr;
+    }
+    io_uring_restriction restrictions[2]{};
+    for (int i = 0; i < 2; i++) {
+        if (opcodes[i] > probe->last_op ||
+            !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+            return nullptr;
+        }
+        restrictions[i].opcode = IORING_RESTRICTION_SQE_OP;
+        restrictions[i].sqe_op = opcodes[i];
+    }
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_RESTRICTIONS,
+                restrictions, 2) != 0 ||
+        syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS,
+                NULL, 0) != 0) {
+        return nullptr;
+    }
+
+    ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(__u32);
+    ring->cqSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        ring->sqSize = ring->cqSize = std::max(ring->sqSize, ring->cqSize);
+    }
+    ring->sqPtr = mmap(0, ring->sqSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqPtr == MAP_FAILED) {
+        return nullptr;
+    }
+    if (singleMmap) {
+        ring->cqPtr = ring->sqPtr;
+    } else {
+        ring->cqPtr =
+            mmap(0, ring->cqSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqPtr == MAP_FAILED) {
+            return nullptr;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = static_cast<io_uring_sqe *>(
+        mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES));
+    if (ring->sqes == MAP_FAILED) {
+        return nullptr;
+    }
+
+    ring->sqHead = ringField<unsigned>(ring->sqPtr, params.sq_off.head);
+    ring->sqTail = ringField<unsigned>(ring->sqPtr, params.sq_off.tail);
+    ring->sqMask = ringField<unsigned>(ring->sqPtr, params.sq_off.ring_mask);
+    ring->sqArray = ringField<unsigned>(ring->sqPtr, params.sq_off.array);
+    ring->cqHead = ringField<unsigned>(ring->cqPtr, params.cq_off.head);
+    ring->cqTail = ringField<unsigned>(ring->cqPtr, params.cq_off.tail);
+    ring->cqMask = ringField<unsigned>(ring->cqPtr, params.cq_off.ring_mask);
+    ring->cqes = ringField<io_uring_cqe>(ring->cqPtr, params.cq_off.cqes);
+    return ring;
+}
+
+} // namespace
+
+LinkBatch::LinkBatch(unsigned queueDepth)
+    : queueDepth(std::max(1u, queueDepth)),
+      start(std::chrono::steady_clock::now()), end(start) {
+    ring = setupRing<Ring>(this->queueDepth);
+    if (ring) {
+        slots.resize(ring->entries);
+        for (std::size_t i = ring->entries; i > 0; i--) {
+            freeSlots.push_back(i - 1);
+        }
+    }
+    debug(boost::format("Link operations use %1% (queue depth %2%)") %
+          (ring ? "io_uring" : "worker threads") % this->queueDepth);
+}
+
+LinkBatch::~LinkBatch() { flush(); }
+
+void LinkBatch::symlink(const fs::path &target, const fs::path &linkPath) {
+    queue({true, target.string(), linkPath.string()});
+}
+
+void LinkBatch::unlink(const fs::path &path) {
+    queue({false, "", path.string()});
+}
+
+void LinkBatch::queue(Op &&op) {
+    // The batch may be created well before the first operation
+    if (queuedOps++ == 0) {
+        start = std::chrono::steady_clock::now();
+    }
+    if (!ring) {
+        pending.push_back(std::move(op));
+        return;
+    }
+
+    // Wait for a free submission slot
+    while (freeSlots.empty()) {
+        enterRing(1);
+    }
+    std::size_t slot = freeSlots.back();
+    freeSlots.pop_back();
+    slots[slot] = std::move(op);
+    const Op &queued = slots[slot];
+
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    io_uring_sqe &sqe = ring->sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = AT_FDCWD;
+    sqe.user_data = slot;
+    if (queued.symlink) {
+        sqe.opcode = IORING_OP_SYMLINKAT;
+        sqe.addr = reinterpret_cast<uintptr_t>(queued.target.c_str());
+        sqe.addr2 = reinterpret_cast<uintptr_t>(queued.path.c_str());
+    } else {
+        sqe.opcode = IORING_OP_UNLINKAT;
+        sqe.addr = reinterpret_cast<uintptr_t>(queued.path.c_str());
+    }
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+void LinkBatch::enterRing(unsigned minComplete) {
+    int ret = syscall(SYS_io_uring_enter, ring->fd, ring->toSubmit,
+                      minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0,
+                      NULL, 0);
+    if (ret > 0) {
+        ring->toSubmit -= ret;
+    } else if (ret == -1 && errno != EINTR && errno != EAGAIN &&
+               errno != EBUSY) {
+        throw std::runtime_error(std::string("io_uring_enter failed: ") +
+                                 strerror(errno));
+    }
+    reapRing();
+}
+
+void LinkBatch::reapRing() {
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const io_uring_cqe &cqe = ring->cqes[head & *ring->cqMask];
+        complete(slots[cqe.user_data], cqe.res);
+        freeSlots.push_back(cqe.user_data);
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+void LinkBatch::runThreads() {
+    std::atomic<std::size_t> next{0};
+    std::mutex mtx;
+    auto worker = [&] {
+        for (std::size_t i; (i = next++) < pending.size();) {
+            const Op &op = pending[i];
+            int ret = op.symlink ? ::symlink(op.target.c_str(), op.path.c_str())
+                                 : ::unlink(op.path.c_str());
+            int res = ret == 0 ? 0 : -errno;
+            const std::lock_guard<std::mutex> lock(mtx);
+            complete(op, res);
+        }
+    };
+
+    unsigned n = std::min<std::size_t>(
+        {queueDepth, std::max(1u, std::thread::hardware_concurrency()),
+         pending.size()});
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < n; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &w : workers) {
+        w.join();
+    }
+    pending.clear();
+}
+
+void LinkBatch::flush() {
+    if (ring) {
+        while (freeSlots.size() < slots.size()) {
+            enterRing(1);
+        }
+    } else if (!pending.empty()) {
+        runThreads();
+    }
+    end = std::chrono::steady_clock::now();
+}
+
+void LinkBatch::complete(const Op &op, int res) {
+    completedOps++;
+    if (res == 0 || (op.symlink && res == -EEXIST) ||
+        (!op.symlink && res == -ENOENT)) {
+        return;
+    }
+    failedOps++;
+    std::cerr << "Couldn't " << (op.symlink ? "create link " : "remove ")
+              << op.path << ": " << strerror(-res) << std::endl;
+}
+
+double LinkBatch::opsPerSecond() const {
+    std::chrono::duration<double> elapsed = end - start;
+    return elapsed.count() > 0 ? completedOps / elapsed.count() : 0;
+}
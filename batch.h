@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/**
+ * Batched execution of symlink and unlink operations. Operations are submitted
+ * through io_uring (IORING_OP_SYMLINKAT / IORING_OP_UNLINKAT) if the kernel
+ * supports it, otherwise they are executed by a pool of worker threads.
+ * Operations are only guaranteed to be completed after flush().
+ */
+class LinkBatch {
+  public:
+    /**
+     * @param queueDepth Maximum number of operations in flight (size of the
+     * submission queue or number of worker threads)
+     */
+    explicit LinkBatch(unsigned queueDepth);
+    ~LinkBatch();
+
+    /**
+     * Create a symlink at linkPath pointing to target. An already existing
+     * link is not an error.
+     */
+    void symlink(const fs::path &target, const fs::path &linkPath);
+
+    /**
+     * Remove a file. A file that doesn't exist is not an error.
+     */
+    void unlink(const fs::path &path);
+
+    /**
+     * Wait until all queued operations have been completed.
+     */
+    void flush();
+
+    bool usesIoUring() const { return ring != nullptr; }
+    std::size_t completed() const { return completedOps; }
+    std::size_t failed() const { return failedOps; }
+
+    /**
+     * @return Operations completed per second between the first queued
+     * operation and the last flush
+     */
+    double opsPerSecond() const;
+
+  private:
+    struct Op {
+        bool symlink;
+        std::string target;
+        std::string path;
+    };
+    struct Ring;
+
+    void queue(Op &&op);
+    void complete(const Op &op, int res);
+    void enterRing(unsigned minComplete);
+    void reapRing();
+    void runThreads();
+
+    unsigned queueDepth;
+    std::unique_ptr<Ring> ring;
+
+    // io_uring: operations in flight, indexed by user_data
+    std::vector<Op> slots;
+    std::vector<std::size_t> freeSlots;
+    // Worker threads: queued operations
+    std::vector<Op> pending;
+
+    std::size_t queuedOps = 0;
+    std::size_t completedOps = 0;
+    std::size_t failedOps = 0;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
@@ -5,7 +5,11 @@
 fs::path nsMntDir(MNTDIR);
 fs::path linksDir(LINKSDIR);
 fs::path executorPath(EXECUTORPATH);
+fs::path lslPath(LSLPATH);
 fs::path config(CONFIGPATH);
+fs::path dedupDir(DEDUPDIR);
+
+bool DEBUG;
 
 class CapWrapper {
   public:
@@ -0,0 +1,648 @@
+#include <boost/format.hpp>
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "dedup.h"
+
+namespace {
+
+/**
+ * Root filesystem of a container. All files are accessed relative to the
+ * directory file descriptor.
+ */
+struct Root {
+    fs::path path;
+    int fd;
+    struct stat st;
+};
+
+/**
+ * Regular file found within one of the root filesystems
+ */
+struct FileEntry {
+    const Root *root;
+    fs::path relPath;
+    struct stat st;
+    std::string hash;
+
+    fs::path path() const { return root->path / relPath; }
+};
+
+/**
+ * Hash of a file as recorded by the previous run
+ */
+struct IndexEntry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    std::string hash;
+};
+
+bool sameVersion(const struct stat &st, const IndexEntry &entry) {
+    return st.st_dev == entry.dev && st.st_ino == entry.ino &&
+           st.st_size == entry.size &&
+           st.st_mtim.tv_sec == entry.mtime.tv_sec &&
+           st.st_mtim.tv_nsec == entry.mtime.tv_nsec;
+}
+
+/**
+ * @return true if both stats refer to the same, unmodified file
+ */
+bool sameVersion(const struct stat &st, const struct stat &other) {
+    return st.st_dev == other.st_dev && st.st_ino == other.st_ino &&
+           st.st_size == other.st_size &&
+           st.st_mtim.tv_sec == other.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == other.st_mtim.tv_nsec;
+}
+
+/**
+ * Collect all regular files below a directory of a root filesystem.
+ * Subdirectories are opened relative to their parent without following
+ * symlinks. Other filesystems mounted below the root and the store are not
+ * entered.
+ * @param dirFd Directory to scan, closed by this function
+ * @param relDir Path of the directory relative to the root
+ */
+void scanDir(const Root &root, int dirFd, const fs::path &relDir,
+             const struct stat &storeSt, std::vector<FileEntry> &entries) {
+    DIR *dir = fdopendir(dirFd);
+    if (!dir) {
+        close(dirFd);
+        return;
+    }
+    while (dirent *ent = readdir(dir)) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            st.st_dev != root.st.st_dev) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (st.st_ino == storeSt.st_ino && st.st_dev == storeSt.st_dev) {
+                continue;
+            }
+            int subFd = openat(dirfd(dir), ent->d_name,
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subFd != -1) {
+                scanDir(root, subFd, relDir / ent->d_name, storeSt, entries);
+            }
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            entries.push_back({&root, relDir / ent->d_name, st, ""});
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Open the directory containing a file. Every path component is opened
+ * relative to its parent without following symlinks, so a directory that has
+ * been replaced by a symlink since the scan can't redirect an operation
+ * outside of the root filesystem.
+ * @return File descriptor of the directory or -1 on error
+ */
+int openParent(const FileEntry &file) {
+    int fd = fcntl(file.root->fd, F_DUPFD_CLOEXEC, 0);
+    for (auto &component : file.relPath.parent_path()) {
+        if (fd == -1) {
+            break;
+        }
+        int next = openat(fd, component.c_str(),
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    return fd;
+}
+
+/**
+ * Open a file relative to its parent directory.
+ * @return File descriptor or -1 if the file can't be opened or isn't the file
+ * found by the scan anymore
+ */
+int openEntry(int parentFd, const FileEntry &file) {
+    int fd = openat(parentFd, file.relPath.filename().c_str(),
+                    O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+                     st.st_ino != file.st.st_ino ||
+                     st.st_dev != file.st.st_dev)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Finish a digest and free its context.
+ * @param ok false if updating the digest failed
+ * @return Hex encoded digest or an empty string on error
+ */
+std::string finishDigest(EVP_MD_CTX *ctx, bool ok) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    ok = ok && EVP_DigestFinal_ex(ctx, digest, &digestLength);
+    EVP_MD_CTX_free(ctx);
+    if (!ok) {
+        return "";
+    }
+
+    std::ostringstream hex;
+    hex << std::hex << std::setfill('0');
+    for (unsigned int i = 0; i < digestLength; i++) {
+        hex << std::setw(2) << static_cast<unsigned int>(digest[i]);
+    }
+    return hex.str();
+}
+
+/**
+ * @return Hex encoded SHA-256 of the file content or an empty string on error
+ */
+std::string hashFile(const FileEntry &file) {
+    int parentFd = openParent(file);
+    if (parentFd == -1) {
+        return "";
+    }
+    int fd = openEntry(parentFd, file);
+    close(parentFd);
+    if (fd == -1) {
+        return "";
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    char buf[1 << 16];
+    ssize_t n = 0;
+    while (ok && (n = read(fd, buf, sizeof(buf))) > 0) {
+        ok = EVP_DigestUpdate(ctx, buf, n);
+    }
+    close(fd);
+    return finishDigest(ctx, ok && n == 0);
+}
+
+/**
+ * Hash the extended attributes of a file (file capabilities, ACLs, security
+ * labels, ...). They are shared by all links of an inode, so files may only
+ * be merged if their attributes are identical.
+ * @return Hex encoded SHA-256 of the names and values of all attributes or an
+ * empty string on error
+ */
+std::string xattrDigest(int fd) {
+    std::vector<char> list;
+    ssize_t size = flistxattr(fd, nullptr, 0);
+    if (size > 0) {
+        list.resize(size);
+        size = flistxattr(fd, list.data(), list.size());
+    }
+    if (size < 0 && errno != ENOTSUP) {
+        return "";
+    }
+    std::vector<std::string> names;
+    for (ssize_t i = 0; i < size; i += names.back().size() + 1) {
+        names.emplace_back(list.data() + i);
+    }
+    std::sort(names.begin(), names.end());
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    std::vector<char> value;
+    for (std::size_t i = 0; ok && i < names.size(); i++) {
+        ssize_t valueSize = fgetxattr(fd, names[i].c_str(), nullptr, 0);
+        if (valueSize > 0) {
+            value.resize(valueSize);
+            valueSize =
+                fgetxattr(fd, names[i].c_str(), value.data(), value.size());
+        }
+        uint64_t length = valueSize;
+        ok = valueSize >= 0 &&
+             EVP_DigestUpdate(ctx, names[i].c_str(), names[i].size() + 1) &&
+             EVP_DigestUpdate(ctx, &length, sizeof(length)) &&
+             EVP_DigestUpdate(ctx, value.data(), valueSize);
+    }
+    return finishDigest(ctx, ok);
+}
+
+/**
+ * Read until buf is full or the end of the file is reached.
+ * @return Number of bytes read or -1 on error
+ */
+ssize_t readFull(int fd, char *buf, std::size_t size) {
+    std::size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, buf + total, size - total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/**
+ * Compare the content of two files byte by byte (a matching hash alone is not
+ * enough to merge them).
+ * @return true if the content is identical, false otherwise or on error
+ */
+bool sameContent(int fd, int otherFd) {
+    std::vector<char> buf(1 << 16), otherBuf(1 << 16);
+    bool same = true;
+    while (same) {
+        ssize_t n = readFull(fd, buf.data(), buf.size());
+        ssize_t otherN = readFull(otherFd, otherBuf.data(), otherBuf.size());
+        same = n >= 0 && n == otherN &&
+               memcmp(buf.data(), otherBuf.data(), n) == 0;
+        if (n <= 0) {
+            break;
+        }
+    }
+    return same;
+}
+
+/**
+ * Compare the content of an object of the store with a file.
+ */
+bool sameContent(const fs::path &object, int parentFd,
+                 const FileEntry &file) {
+    int objectFd = open(object.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (objectFd == -1) {
+        return false;
+    }
+    int fd = openEntry(parentFd, file);
+    bool same = fd != -1 && sameContent(objectFd, fd);
+    if (fd != -1) {
+        close(fd);
+    }
+    close(objectFd);
+    return same;
+}
+
+std::unordered_map<std::string, IndexEntry> readIndex(const fs::path &path) {
+    std::unordered_map<std::string, IndexEntry> index;
+    std::ifstream in(path);
+    IndexEntry entry;
+    std::string file;
+    while (in >> entry.hash >> entry.dev >> entry.ino >> entry.size >>
+           entry.mtime.tv_sec >> entry.mtime.tv_nsec) {
+        in.ignore(1);
+        std::getline(in, file);
+        index.emplace(file, entry);
+    }
+    return index;
+}
+
+void writeIndex(const fs::path &path, const std::vector<FileEntry> &files) {
+    fs::path tmp = path.string() + ".tmp";
+    {
+        std::ofstream out(tmp);
+        for (auto &file : files) {
+            if (file.hash.empty()) {
+                continue;
+            }
+            out << file.hash << ' ' << file.st.st_dev << ' ' << file.st.st_ino
+                << ' ' << file.st.st_size << ' ' << file.st.st_mtim.tv_sec
+                << ' ' << file.st.st_mtim.tv_nsec << ' '
+                << file.path().string() << '\n';
+        }
+        if (!out) {
+            std::cerr << "Couldn't write dedup index " << tmp << std::endl;
+            return;
+        }
+    }
+    fs::rename(tmp, path);
+}
+
+/**
+ * Name of the store object for a file. Files only share an inode if their
+ * metadata is identical, so the metadata is part of the name.
+ * @param xattrs Digest of the extended attributes (see xattrDigest)
+ */
+std::string objectName(const std::string &hash, const struct stat &st,
+                       const std::string &xattrs) {
+    return (boost::format("%1%-%2$o-%3%-%4%-%5%.%6$09d-%7%") % hash %
+            (st.st_mode & 07777) % st.st_uid % st.st_gid %
+            st.st_mtim.tv_sec % st.st_mtim.tv_nsec % xattrs)
+        .str();
+}
+
+/**
+ * Check that an object hasn't been modified in place (through one of its
+ * links) since it has been added to the store.
+ * @param object Path to the object
+ * @param st Stat of the object
+ */
+bool isIntact(const fs::path &object, const struct stat &st) {
+    int fd = open(object.c_str(),
+                  O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    std::string xattrs = xattrDigest(fd);
+    close(fd);
+    std::string name = object.filename().string();
+    return !xattrs.empty() &&
+           objectName(name.substr(0, name.find('-')), st, xattrs) == name;
+}
+
+/**
+ * Let the file share the disk blocks of source (FIDEDUPERANGE). The kernel
+ * only shares blocks with identical content and leaves the file (including
+ * its mtime) untouched otherwise.
+ * @return true if the file has been reflinked, false otherwise
+ */
+bool reflink(const fs::path &source, int parentFd, const FileEntry &file) {
+    int src = open(source.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src == -1) {
+        return false;
+    }
+    // Opening the file read only is sufficient with CAP_DAC_OVERRIDE and
+    // doesn't fail for binaries that are currently executed
+    int dst = openEntry(parentFd, file);
+    if (dst == -1) {
+        close(src);
+        return false;
+    }
+
+    // Filesystems limit the length of a single request
+    constexpr off_t chunk = 16 << 20;
+    std::vector<char> buf(sizeof(file_dedupe_range) +
+                          sizeof(file_dedupe_range_info));
+    auto range = reinterpret_cast<file_dedupe_range *>(buf.data());
+    bool ret = true;
+    for (off_t offset = 0; ret && offset < file.st.st_size;) {
+        std::fill(buf.begin(), buf.end(), 0);
+        range->src_offset = offset;
+        range->src_length = std::min(chunk, file.st.st_size - offset);
+        range->dest_count = 1;
+        range->info[0].dest_fd = dst;
+        range->info[0].dest_offset = offset;
+        ret = ioctl(src, FIDEDUPERANGE, range) == 0 &&
+              range->info[0].status == FILE_DEDUPE_RANGE_SAME &&
+              range->info[0].bytes_deduped > 0;
+        offset += range->info[0].bytes_deduped;
+    }
+    close(dst);
+    close(src);
+    return ret;
+}
+
+/**
+ * Atomically replace a file by a hardlink to object.
+ * @param parentFd Directory containing the file
+ * @return true if the file has been replaced, false otherwise
+ */
+bool replaceByLink(const fs::path &object, int parentFd,
+                   const FileEntry &file) {
+    std::string name = file.relPath.filename().string();
+    std::string tmp = "." + name + ".lsl-dedup";
+    if (linkat(AT_FDCWD, object.c_str(), parentFd, tmp.c_str(), 0) != 0) {
+        return false;
+    }
+    if (renameat(parentFd, tmp.c_str(), parentFd, name.c_str()) != 0) {
+        unlinkat(parentFd, tmp.c_str(), 0);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Replace a file by a hardlink to the object with the same content and
+ * metadata, or add it to the store if there is none yet.
+ * @param parentFd Directory containing the file
+ * @param objectsByHash Intact objects of the store, by content
+ */
+void linkIntoStore(FileEntry &file, int parentFd, const fs::path &objects,
+                   std::unordered_map<std::string, fs::path> &objectsByHash,
+                   DedupStats &stats) {
+    // Skip files that changed since they have been hashed
+    struct stat st;
+    std::string xattrs;
+    int fd = openEntry(parentFd, file);
+    if (fd != -1) {
+        xattrs = xattrDigest(fd);
+        close(fd);
+    }
+    if (xattrs.empty() ||
+        fstatat(parentFd, file.relPath.filename().c_str(), &st,
+                AT_SYMLINK_NOFOLLOW) != 0 ||
+        !sameVersion(st, file.st)) {
+        file.hash.clear();
+        stats.skipped++;
+        return;
+    }
+
+    fs::path dir = objects / file.hash.substr(0, 2);
+    fs::path object = dir / objectName(file.hash, st, xattrs);
+    struct stat objectSt;
+    bool exists = lstat(object.c_str(), &objectSt) == 0;
+    if (exists && !isIntact(object, objectSt)) {
+        unlink(object.c_str());
+        exists = false;
+    }
+    if (exists) {
+        if (objectSt.st_ino == st.st_ino && objectSt.st_dev == st.st_dev) {
+            return;
+        }
+        if (objectSt.st_dev != st.st_dev ||
+            !sameContent(object, parentFd, file) ||
+            !replaceByLink(object, parentFd, file)) {
+            stats.skipped++;
+            return;
+        }
+        debug(boost::format("link(%1%, %2%)") % object % file.path());
+        stats.linked++;
+        if (st.st_nlink == 1) {
+            stats.savedBytes += st.st_size;
+        }
+    } else {
+        // First file with this metadata, at least share the blocks with
+        // the content of another file with other metadata
+        auto other = objectsByHash.find(file.hash);
+        if (other != objectsByHash.end() &&
+            sameContent(other->second, parentFd, file) &&
+            reflink(other->second, parentFd, file)) {
+            debug(boost::format("reflink(%1%, %2%)") % other->second %
+                  file.path());
+            stats.reflinked++;
+            stats.savedBytes += st.st_size;
+        }
+        fs::create_directories(dir);
+        if (linkat(parentFd, file.relPath.filename().c_str(), AT_FDCWD,
+                   object.c_str(), 0) != 0) {
+            stats.skipped++;
+            return;
+        }
+        // The file might have been replaced since it has been checked
+        if (lstat(object.c_str(), &objectSt) != 0 ||
+            objectSt.st_ino != st.st_ino) {
+            unlink(object.c_str());
+            stats.skipped++;
+            return;
+        }
+        objectsByHash.emplace(file.hash, object);
+    }
+
+    // Record the inode the path refers to now
+    fstatat(parentFd, file.relPath.filename().c_str(), &file.st,
+            AT_SYMLINK_NOFOLLOW);
+}
+
+} // namespace
+
+DedupStats dedup(const std::vector<fs::path> &rootPaths, const fs::path &store,
+                 bool incremental) {
+    DedupStats stats;
+    fs::path objects = store / "objects";
+    fs::path indexPath = store / "index";
+    fs::create_directories(objects);
+    struct stat storeSt;
+    if (stat(store.c_str(), &storeSt) != 0) {
+        std::cerr << "Couldn't stat " << store << std::endl;
+        return stats;
+    }
+
+    std::vector<Root> roots;
+    for (auto &path : rootPaths) {
+        Root root{path, open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+                  {}};
+        if (root.fd == -1 || fstat(root.fd, &root.st) != 0) {
+            std::cerr << "Couldn't open " << path << std::endl;
+            if (root.fd != -1) {
+                close(root.fd);
+            }
+            continue;
+        }
+        roots.push_back(root);
+    }
+
+    // Scan all root filesystems in parallel
+    std::vector<std::vector<FileEntry>> scanned(roots.size());
+    {
+        std::vector<std::thread> scanners;
+        for (std::size_t i = 0; i < roots.size(); i++) {
+            scanners.emplace_back([&, i] {
+                int fd = fcntl(roots[i].fd, F_DUPFD_CLOEXEC, 0);
+                if (fd != -1) {
+                    scanDir(roots[i], fd, "", storeSt, scanned[i]);
+                }
+            });
+        }
+        for (auto &scanner : scanners) {
+            scanner.join();
+        }
+    }
+    std::vector<FileEntry> files;
+    for (auto &entries : scanned) {
+        files.insert(files.end(), std::make_move_iterator(entries.begin()),
+                     std::make_move_iterator(entries.end()));
+    }
+    stats.files = files.size();
+
+    // Reuse hashes of files that haven't changed since the last run
+    std::vector<FileEntry *> todo;
+    {
+        std::unordered_map<std::string, IndexEntry> index;
+        if (incremental) {
+            index = readIndex(indexPath);
+        }
+        for (auto &file : files) {
+            auto it = index.find(file.path().string());
+            if (it != index.end() && sameVersion(file.st, it->second)) {
+                file.hash = it->second.hash;
+            } else {
+                todo.push_back(&file);
+            }
+        }
+    }
+
+    // Hash the remaining files in parallel
+    {
+        std::atomic<std::size_t> next{0};
+        std::vector<std::thread> workers;
+        unsigned n = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < n; i++) {
+            workers.emplace_back([&] {
+                for (std::size_t j; (j = next++) < todo.size();) {
+                    todo[j]->hash = hashFile(*todo[j]);
+                }
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+    stats.hashed = todo.size();
+
+    // Objects that are already in the store, by content
+    std::unordered_map<std::string, fs::path> objectsByHash;
+    for (auto &dir : fs::directory_iterator(objects)) {
+        for (auto &object : fs::directory_iterator(dir.path())) {
+            std::string name = object.path().filename().string();
+            struct stat objectSt;
+            if (lstat(object.path().c_str(), &objectSt) == 0 &&
+                isIntact(object.path(), objectSt)) {
+                objectsByHash.emplace(name.substr(0, name.find('-')),
+                                      object.path());
+            }
+        }
+    }
+
+    // Link the files into the store
+    for (auto &file : files) {
+        if (file.hash.empty()) {
+            stats.skipped++;
+            continue;
+        }
+        int parentFd = openParent(file);
+        if (parentFd == -1) {
+            file.hash.clear();
+            stats.skipped++;
+            continue;
+        }
+        linkIntoStore(file, parentFd, objects, objectsByHash, stats);
+        close(parentFd);
+    }
+
+    // Remove objects that are no longer referenced by any container or that
+    // have been modified
+    for (auto &dir : fs::directory_iterator(objects)) {
+        for (auto &object : fs::directory_iterator(dir.path())) {
+            struct stat objectSt;
+            if (lstat(object.path().c_str(), &objectSt) == 0 &&
+                (objectSt.st_nlink == 1 ||
+                 !isIntact(object.path(), objectSt)) &&
+                fs::remove(object.path())) {
+                stats.pruned++;
+            }
+        }
+    }
+
+    writeIndex(indexPath, files);
+    for (auto &root : roots) {
+        close(root.fd);
+    }
+    return stats;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+/**
+ * Statistics of a dedup run
+ */
+struct DedupStats {
+    std::size_t files = 0;
+    std::size_t hashed = 0;
+    std::size_t linked = 0;
+    std::size_t reflinked = 0;
+    std::size_t skipped = 0;
+    std::size_t pruned = 0;
+    uintmax_t savedBytes = 0;
+};
+
+/**
+ * Replace byte-identical files within the given root filesystems by hardlinks
+ * into a content-addressed store. Only files with identical owner, mode and
+ * mtime share an inode; identical files with other metadata are reflinked
+ * (if supported by the filesystem) to share at least the disk blocks.
+ * @param roots Root filesystems of the containers
+ * @param store Directory of the store, must be on the same filesystem
+ * @param incremental Reuse hashes of unchanged files from the last run
+ * @return Statistics of the run
+ */
+DedupStats dedup(const std::vector<fs::path> &roots, const fs::path &store,
+                 bool incremental);
@@ -6,26 +6,137 @@
 #include <cerrno>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "filter.h"
+
+#ifdef EXECUTOR_SECCOMP
+// Syscalls that neither lslExecutor nor the executed binary should need to
+// reconfigure the mount namespace. As the filter stays active after execv it is
+// a deny list, everything else is still permitted.
+constexpr auto executorSeccompFilter = makeSeccompDenyList(std::array{
+    SYS_mount,
+    SYS_umount2,
+    SYS_pivot_root,
+    SYS_chroot,
+#ifdef SYS_open_tree
+    SYS_open_tree,
+    SYS_move_mount,
+    SYS_fsopen,
+    SYS_fsconfig,
+    SYS_fsmount,
+    SYS_fspick,
+#endif
+    SYS_kexec_load,
+    SYS_init_module,
+    SYS_finit_module,
+    SYS_delete_module,
+    SYS_reboot,
+    SYS_swapon,
+    SYS_swapoff,
+});
+#endif
 
 namespace bpt = boost::property_tree;
 namespace ba = boost::algorithm;
 
 extern char **env;
 
+/**
+ * Start "lsl replenish <container>" in the background to refill the pool of
+ * ephemeral namespaces. The process is double forked so that it is neither
+ * waited for nor left as a zombie of the executed binary.
+ * @param container Name of the container
+ */
+void spawnReplenish(const std::string &container) {
+    pid_t child = fork();
+    if (child == 0) {
+        if (fork() == 0) {
+            setsid();
+            int devNull = open("/dev/null", O_RDWR);
+            dup2(devNull, STDIN_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+            char *const envp[] = {NULL};
+            execle(lslPath.c_str(), lslPath.c_str(), "replenish",
+                   container.c_str(), NULL, envp);
+        }
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+}
+
+/**
+ * Take a namespace out of the pool of ephemeral namespaces of a container.
+ * The slot stays claimed and the namespace bind mounted while the executed
+ * binary runs, so lsl ps and lsl stop --drain find its processes. The next
+ * lsl replenish discards the namespace (and its writable layer) once no
+ * process is left in it.
+ * @param poolDir Directory containing the pool (nsMntDir/<container>@ephemeral)
+ * @param lockFd Lock of the pool. It is held (shared) on success and has to
+ * be released once the namespace has been entered, so that replenish doesn't
+ * discard the namespace before.
+ * @return File descriptor of the namespace or -1 if the pool is empty
+ */
+int claimEphemeralNamespace(const fs::path &poolDir, int lockFd) {
+    // Don't block while lsl replenish holds the lock, the caller retries
+    if (flock(lockFd, LOCK_SH | LOCK_NB) != 0) {
+        return -1;
+    }
+    for (auto &p : fs::directory_iterator(poolDir)) {
+        std::string name = p.path().filename().string();
+        if (!ba::starts_with(name, "ns-") ||
+            p.path().extension() == ".claimed") {
+            continue;
+        }
+
+        // Slots that are claimed or still being set up by lsl have a
+        // .claimed file
+        fs::path claimed = p.path().string() + ".claimed";
+        int claimFd = open(claimed.c_str(), O_CREAT | O_EXCL | O_RDONLY, 0600);
+        if (claimFd == -1) {
+            continue;
+        }
+        close(claimFd);
+
+        int fd = open(p.path().c_str(), O_RDONLY);
+        if (fd != -1) {
+            return fd;
+        }
+        std::cerr << "Couldn't open " << p.path() << std::endl;
+    }
+    flock(lockFd, LOCK_UN);
+    return -1;
+}
+
 int main(int argc, char **argv) {
     // CAP_SYS_CHROOT and CAP_SYS_ADMIN are needed to enter mount namespace
     dropToCapabilities({CAP_SYS_CHROOT, CAP_SYS_ADMIN});
 
+    // Execute in a namespace of the pool of ephemeral namespaces
+    bool ephemeral = false;
+    if (argc > 1 && strcmp(argv[1], "--ephemeral") == 0) {
+        ephemeral = true;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     if (!ba::contains(argv[0], ":") && argc < 3) {
-        std::cout << "Usage: " << argv[0] << " container path-to-bin <args...>"
+        std::cout << "Usage: " << argv[0]
+                  << " [--ephemeral] container path-to-bin <args...>"
                   << std::endl;
         std::cout << "Alternative: rename or link to ./container:bin <args...>"
                   << std::endl;
+        std::cout << "Ephemeral: rename or link to ./container@ephemeral:bin "
+                     "<args...>"
+                  << std::endl;
         return 0;
     }
 
@@ -43,11 +154,20 @@ int main(int argc, char **argv) {
     } else {
         container = argv[1];
         binary = argv[2];
-        args = std::vector<char *>(argv + 2, argv + (argc - 2));
+        args = std::vector<char *>(argv + 2, argv + argc);
     }
     args.push_back(NULL);
 
+    const std::string ephemeralSuffix = "@ephemeral";
+    if (ba::ends_with(container, ephemeralSuffix)) {
+        ephemeral = true;
+        container.erase(container.size() - ephemeralSuffix.size());
+    }
+
     fs::path containerPath = nsMntDir / container;
+    if (ephemeral) {
+        containerPath += ephemeralSuffix;
+    }
     if (!fs::exists(containerPath)) {
         std::cerr << "Container " << container << " seems not to be enabled."
                   << std::endl;
@@ -63,10 +183,35 @@ int main(int argc, char **argv) {
     free(cwd_cstr);
 
     // Enter mount namespace of the container
-    int fd = open(containerPath.c_str(), O_RDONLY);
-    if (fd == -1) {
-        std::cerr << "Couldn't open namespace file" << std::endl;
-        return 1;
+    int fd;
+    int lockFd = -1;
+    if (ephemeral) {
+        lockFd = open((containerPath / "lock").c_str(), O_RDONLY | O_CLOEXEC);
+        if (lockFd == -1) {
+            std::cerr << "Couldn't open lock of the pool of " << container
+                      << std::endl;
+            return 1;
+        }
+        // Refill the pool for the next invocation while this one runs (after
+        // the claim, so the replenish sees the slot as taken). If the pool is
+        // empty wait for the namespace created by the replenish.
+        fd = claimEphemeralNamespace(containerPath, lockFd);
+        spawnReplenish(container);
+        for (int i = 0; fd == -1 && i < 500; i++) {
+            usleep(10000);
+            fd = claimEphemeralNamespace(containerPath, lockFd);
+        }
+        if (fd == -1) {
+            std::cerr << "No ephemeral namespace of " << container
+                      << " available" << std::endl;
+            return 1;
+        }
+    } else {
+        fd = open(containerPath.c_str(), O_RDONLY);
+        if (fd == -1) {
+            std::cerr << "Couldn't open namespace file" << std::endl;
+            return 1;
+        }
     }
     if (setns(fd, CLONE_NEWNS) != 0) {
         std::cerr << "Couldn't enter namespace: " << strerror(errno)
@@ -74,6 +219,15 @@ int main(int argc, char **argv) {
         return 1;
     }
     close(fd);
+    if (lockFd != -1) {
+        close(lockFd);
+    }
+
+#ifdef EXECUTOR_SECCOMP
+    // CAP_SYS_ADMIN is held, so no new privs is not required. This keeps
+    // setuid binaries (e.g. sudo) working inside the container.
+    executorSeccompFilter.load(false);
+#endif
 
     // Get current credentials to be able to drop back after entering the mount
     // namespace
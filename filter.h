@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__i386__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_I386
+#elif defined(__arm__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_ARM
+#else
+#error "Unsupported architecture for the seccomp filter"
+#endif
+
+#ifndef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_KILL_PROCESS 0x80000000U
+#endif
+
+/**
+ * Classic BPF seccomp program that is generated at compile time (see
+ * makeSeccompFilter) and only has to be handed to the kernel at runtime.
+ */
+template <std::size_t N> struct SeccompFilter {
+    std::array<sock_filter, N> insns{};
+
+    /**
+     * Install the filter for the calling thread (and all its descendants).
+     * @param noNewPrivs Set PR_SET_NO_NEW_PRIVS before loading the filter.
+     * This may only be skipped if CAP_SYS_ADMIN is held.
+     */
+    void load(bool noNewPrivs = true) const {
+        if (noNewPrivs && prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+            throw std::runtime_error("Couldn't set no new privs");
+        }
+        sock_fprog prog{static_cast<unsigned short>(N),
+                        const_cast<sock_filter *>(insns.data())};
+        if (syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, &prog) != 0) {
+            throw std::runtime_error("Couldn't load seccomp filter");
+        }
+    }
+};
+
+namespace detail {
+
+constexpr sock_filter bpfStmt(uint16_t code, uint32_t k) {
+    return {code, 0, 0, k};
+}
+
+constexpr sock_filter bpfJump(uint16_t code, uint32_t k, uint8_t jt,
+                              uint8_t jf) {
+    return {code, jt, jf, k};
+}
+
+#if defined(__x86_64__)
+// Check arch, load syscall number, reject or unmask x32 syscalls
+constexpr std::size_t prologueLength = 6;
+#else
+// Check arch, load syscall number
+constexpr std::size_t prologueLength = 4;
+#endif
+
+/**
+ * Number of instructions of the search tree over count syscall numbers:
+ * 3 per leaf (compare, match, fallback) and 1 per inner node.
+ */
+constexpr std::size_t treeLength(std::size_t count) {
+    return count <= 1 ? 3 * count
+                      : 1 + treeLength(count / 2) +
+                            treeLength(count - count / 2);
+}
+
+/**
+ * Emit a binary search over the sorted syscall numbers nrs[0, count) at pos.
+ * Inner nodes jump over their left subtree if the syscall number is greater
+ * or equal to the first number of the right subtree.
+ * @return Position behind the emitted subtree
+ */
+template <std::size_t N>
+constexpr std::size_t emitTree(std::array<sock_filter, N> &insns,
+                               std::size_t pos, const int *nrs,
+                               std::size_t count, uint32_t match,
+                               uint32_t fallback) {
+    if (count == 1) {
+        insns[pos++] = bpfJump(BPF_JMP | BPF_JEQ | BPF_K, nrs[0], 0, 1);
+        insns[pos++] = bpfStmt(BPF_RET | BPF_K, match);
+        insns[pos++] = bpfStmt(BPF_RET | BPF_K, fallback);
+        return pos;
+    }
+    std::size_t mid = count / 2;
+    insns[pos++] = bpfJump(BPF_JMP | BPF_JGE | BPF_K, nrs[mid],
+                           static_cast<uint8_t>(treeLength(mid)), 0);
+    pos = emitTree(insns, pos, nrs, mid, match, fallback);
+    return emitTree(insns, pos, nrs + mid, count - mid, match, fallback);
+}
+
+} // namespace detail
+
+/**
+ * Build a seccomp filter at compile time that applies match to all listed
+ * syscalls and fallback to every other syscall.
+ * @param syscalls Syscall numbers (SYS_*), in any order
+ * @param match Seccomp return value for listed syscalls
+ * @param fallback Seccomp return value for all other syscalls
+ * @param foreign Seccomp return value for syscalls of a foreign architecture
+ * (e.g. i386 on x86_64), whose numbers differ. If they are allowed, x32
+ * syscalls on x86_64 are checked like native ones, as they share the numbers.
+ * Otherwise they are handled like foreign ones.
+ */
+template <std::size_t S>
+constexpr SeccompFilter<detail::prologueLength + detail::treeLength(S)>
+makeSeccompFilter(std::array<int, S> syscalls, uint32_t match,
+                  uint32_t fallback, uint32_t foreign) {
+    using namespace detail;
+    static_assert(S > 0, "Seccomp filter needs at least one syscall");
+    // BPF jump offsets are 8 bit wide, the left subtree of the root is the
+    // largest jump
+    static_assert(treeLength(S / 2) <= 255, "Too many syscalls for filter");
+
+    // Insertion sort (std::sort is not constexpr in C++17)
+    for (std::size_t i = 1; i < S; ++i) {
+        for (std::size_t j = i; j > 0 && syscalls[j - 1] > syscalls[j]; --j) {
+            int tmp = syscalls[j];
+            syscalls[j] = syscalls[j - 1];
+            syscalls[j - 1] = tmp;
+        }
+    }
+
+    SeccompFilter<prologueLength + treeLength(S)> filter{};
+    auto &insns = filter.insns;
+    std::size_t pos = 0;
+    insns[pos++] = bpfStmt(BPF_LD | BPF_W | BPF_ABS,
+                           offsetof(struct seccomp_data, arch));
+    insns[pos++] = bpfJump(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0);
+    insns[pos++] = bpfStmt(BPF_RET | BPF_K, foreign);
+    insns[pos++] =
+        bpfStmt(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+#if defined(__x86_64__)
+    insns[pos++] = bpfJump(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1);
+    insns[pos++] = foreign == SECCOMP_RET_ALLOW
+                       ? bpfStmt(BPF_ALU | BPF_AND | BPF_K, ~__X32_SYSCALL_BIT)
+                       : bpfStmt(BPF_RET | BPF_K, foreign);
+#endif
+    emitTree(insns, pos, syscalls.data(), S, match, fallback);
+    return filter;
+}
+
+/**
+ * Filter that only permits the listed syscalls and kills the whole process
+ * otherwise, including syscalls of a foreign architecture.
+ */
+template <std::size_t S>
+constexpr auto makeSeccompAllowList(const std::array<int, S> &syscalls) {
+    return makeSeccompFilter(syscalls, SECCOMP_RET_ALLOW,
+                             SECCOMP_RET_KILL_PROCESS, SECCOMP_RET_KILL_PROCESS);
+}
+
+/**
+ * Filter that lets the listed syscalls fail with EPERM and permits all others.
+ * Syscalls of a foreign architecture are not filtered, so that e.g. i386
+ * binaries keep working.
+ */
+template <std::size_t S>
+constexpr auto makeSeccompDenyList(const std::array<int, S> &syscalls) {
+    return makeSeccompFilter(syscalls, SECCOMP_RET_ERRNO | EPERM,
+                             SECCOMP_RET_ALLOW, SECCOMP_RET_ALLOW);
+}
@@ -7,13 +7,13 @@
 #include <iostream>
 #include <optional>
 #include <vector>
-#include <mutex>
 
 #define _GNU_SOURCE 1
 #include <cerrno>
+#include <cstdio>
 #include <fcntl.h>
 #include <sched.h>
-#include <seccomp.h>
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
@@ -22,7 +22,11 @@
 #include <unistd.h>
 #include <wait.h>
 
+#include "batch.h"
 #include "common.h"
+#include "dedup.h"
+#include "filter.h"
+#include "ps.h"
 
 namespace bpt = boost::property_tree;
 namespace ba = boost::algorithm;
@@ -35,15 +39,17 @@ class SubsystemConfig {
     SubsystemConfig(const std::string &name, const fs::path &path,
                     const std::vector<std::pair<fs::path, fs::path>> &mntPoints,
                     const std::vector<fs::path> &bins,
-                    const std::optional<fs::path> &interpreter)
+                    const std::optional<fs::path> &interpreter,
+                    unsigned ephemeralPoolSize)
         : name(name), path(path), mntPoints(mntPoints), bins(bins),
-          interpreter(interpreter) {}
+          interpreter(interpreter), ephemeralPoolSize(ephemeralPoolSize) {}
 
     std::string name;
     fs::path path;
     std::vector<std::pair<fs::path, fs::path>> mntPoints;
     std::vector<fs::path> bins;
     std::optional<fs::path> interpreter;
+    unsigned ephemeralPoolSize;
 };
 
 /**
@@ -61,10 +67,14 @@ inline bool createFile(const fs::path &path) {
     return true;
 }
 
-bool DEBUG;
-template <typename M> void debug(const M &m) {
-    if (DEBUG)
-        std::cout << "[DEBUG] " << m << std::endl;
+/**
+ * Check whether a mount namespace is bind mounted to the given file.
+ * @return true if path is a namespace file (of nsfs), false otherwise
+ */
+inline bool isNamespaceMount(const fs::path &path) {
+    struct stat nsSt, st;
+    return stat("/proc/self/ns/mnt", &nsSt) == 0 &&
+           stat(path.c_str(), &st) == 0 && st.st_dev == nsSt.st_dev;
 }
 
 /**
@@ -81,14 +91,20 @@ inline bool mountWrapper(const fs::path &source, const fs::path &target,
 }
 
 /**
- * Binds the mount namespace of the parent process to nsMntDir/<container-name>
+ * Binds the mount namespace of the parent process to nsMntDir/<namespace-name>
  * (default /tmp/subsys/<container-name>)
- * @param data (std::string*) name of the container
+ * @param data (std::pair<std::string, int*>*) name of the namespace file
+ * relative to nsMntDir and pipe the parent writes to once the namespace is
+ * created (or closes if it failed)
  * @return 0 if the mount namespace has successfully been mounted, 1 otherwise
  */
 int childBindMountNamespace(void *data) {
-    auto pair = reinterpret_cast<std::pair<std::string, std::mutex*>*>(data);
+    auto pair = reinterpret_cast<std::pair<std::string, int*>*>(data);
     fs::path nsMntPath = nsMntDir / pair->first;
+    int *pipeFds = pair->second;
+    // Only the write end of the parent may be left, so that read returns
+    // once it is closed
+    close(pipeFds[1]);
 
     // Create file to mount ot if not already existing
     if (!fs::exists(nsMntPath)) {
@@ -102,85 +118,585 @@ int childBindMountNamespace(void *data) {
     fs::path mntNs = fs::path("/proc/") / std::to_string(getppid()) / "ns/mnt";
 
     // Wait until mount namespace is entered by parent
-    {
-        const std::lock_guard<std::mutex> lock(*(pair->second));
-        if (!mountWrapper(mntNs, nsMntPath, 0, MS_BIND, 0)) {
-            std::cerr << "Couldn't create bind mount for mount namespace of "
-                    << pair->first << ": " << strerror(errno) << std::endl;
+    char unshared;
+    if (read(pipeFds[0], &unshared, 1) != 1) {
+        return 1;
+    }
+    if (!mountWrapper(mntNs, nsMntPath, 0, MS_BIND, 0)) {
+        std::cerr << "Couldn't create bind mount for mount namespace of "
+                  << pair->first << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Parse the configuration file.
+ * @return The configured containers
+ */
+std::vector<SubsystemConfig> parseConfig() {
+    bpt::ptree pt;
+    bpt::ini_parser::read_ini(config, pt);
+    std::vector<SubsystemConfig> subsystems;
+    for (auto &section : pt) {
+
+        const std::string &name = section.first;
+        fs::path path;
+        std::vector<std::pair<fs::path, fs::path>> mntPoints;
+        std::vector<fs::path> bins;
+        std::optional<fs::path> interpreter;
+        unsigned ephemeralPoolSize = 0;
+
+        // Mount /dev and /run by default
+        mntPoints.emplace_back("/dev", "/dev");
+        mntPoints.emplace_back("/run", "/run");
+
+        for (auto &option : section.second) {
+            if (option.first == "path") {
+                path = option.second.get_value<fs::path>();
+                if (!fs::exists(path) || !fs::is_directory(path)) {
+                    std::cerr << path
+                              << " is not a path to a directory. Ignoring "
+                              << name << std::endl;
+                    continue;
+                }
+            } else if (option.first == "mnt") {
+                std::string v = option.second.get_value<std::string>();
+                std::vector<std::string> mntPointsTemp;
+                ba::split(mntPointsTemp, v, boost::is_any_of(";"));
+                for (auto &mntPoint : mntPointsTemp) {
+                    std::vector<fs::path> mntPaths;
+                    ba::split(mntPaths, mntPoint, boost::is_any_of(":"));
+                    std::pair<fs::path, fs::path> mntInfo;
+                    if (mntPaths.size() > 1) {
+                        mntInfo = {mntPaths[0], mntPaths[1]};
+                    } else {
+                        mntInfo = {mntPaths[0], mntPaths[0]};
+                    }
+                    if (!fs::exists(mntPaths[0])) {
+                        std::cerr << "File " << mntPaths[0]
+                                  << "couldn't be found. Ignoring mount..."
+                                  << std::endl;
+                        continue;
+                    }
+                    mntPoints.push_back(mntInfo);
+                }
+            } else if (option.first == "bins") {
+                std::string v = option.second.get_value<std::string>();
+                ba::split(bins, v, boost::is_any_of(";"));
+            } else if (option.first == "interpreter") {
+                interpreter = option.second.get_value<std::string>();
+            } else if (option.first == "ephemeral") {
+                ephemeralPoolSize = option.second.get_value<unsigned>();
+            }
+        }
+        subsystems.emplace_back(name, path, mntPoints, bins, interpreter,
+                                ephemeralPoolSize);
+    }
+    return subsystems;
+}
+
+/**
+ * Create a mount namespace for a container, perform the mounts and pivot_root
+ * into the root filesystem of the container. Must be called in a child process
+ * as the calling process ends up in the new mount namespace.
+ * @param subsystem Container to create the namespace for
+ * @param nsName Name of the file (relative to nsMntDir) the namespace is bind
+ * mounted to
+ * @param ephemeralDir If set, the root filesystem is an overlay with a tmpfs
+ * backed writable layer that is mounted within this directory
+ * @return 0 if the namespace has been set up, 1 otherwise
+ */
+int setupNamespace(const SubsystemConfig &subsystem, const std::string &nsName,
+                   const std::optional<fs::path> &ephemeralDir) {
+    // Create mount namespace and bind mount it to keep it alive after the
+    // child exits.
+    // The child shares the memory of this process, so the name and the pipe
+    // have to stay alive until it exited. A mutex can't be used to wait for
+    // the unshare, as glibc doesn't expect another thread sharing the memory.
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+        std::cerr << "Couldn't create pipe: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    char *stk = new char[1024*1024];
+    auto data = std::make_pair(nsName, pipeFds);
+    // Use clone directly to create a child process with different pid but
+    // same virtual memory
+    pid_t child = clone(childBindMountNamespace, stk + 1024*1024,
+                        CLONE_VM | CLONE_CHILD_CLEARTID | SIGCHLD, &(data));
+    if (child == -1) {
+        std::cerr << "Couldn't create child process: " << strerror(errno)
+                  << std::endl;
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        delete[] stk;
+        return 1;
+    }
+    bool unshared = unshare(CLONE_NEWNS) == 0;
+    if (!unshared) {
+        std::cerr << "Couldn't create mount namespace: " << strerror(errno)
+                  << ". Exiting..." << std::endl;
+    } else if (write(pipeFds[1], "1", 1) != 1) {
+        unshared = false;
+    }
+    close(pipeFds[1]);
+    int status;
+    waitpid(child, &status, 0);
+    close(pipeFds[0]);
+    delete[] stk;
+    if (!unshared || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return 1;
+    }
+
+    // Configure all mount points of the new mount namespace as slaves to not
+    // propagate the following mounts
+    if (!mountWrapper("", "/", 0, MS_SLAVE | MS_REC, 0)) {
+        std::cerr << "Couldn't set root mount as slave" << std::endl;
+        return 1;
+    }
+
+    fs::path rootPath = subsystem.path;
+    if (ephemeralDir) {
+        // Writes to the container end up in a tmpfs that only lives as long
+        // as the mount namespace
+        if (!mountWrapper("", *ephemeralDir, "tmpfs", 0, 0)) {
+            std::cerr << "Couldn't mount tmpfs for ephemeral namespace"
+                      << std::endl;
             return 1;
         }
+        rootPath = *ephemeralDir / "root";
+        fs::create_directory(*ephemeralDir / "upper");
+        fs::create_directory(*ephemeralDir / "work");
+        fs::create_directory(rootPath);
+        std::string options =
+            "lowerdir=" + subsystem.path.string() +
+            ",upperdir=" + (*ephemeralDir / "upper").string() +
+            ",workdir=" + (*ephemeralDir / "work").string();
+        if (!mountWrapper("overlay", rootPath, "overlay", 0, options.c_str())) {
+            std::cerr << "Couldn't mount overlay for ephemeral namespace"
+                      << std::endl;
+            return 1;
+        }
+    } else {
+        // Bind mount the directory containing the new root filesystem to
+        // itself to enable usage of pivot_root
+        if (!mountWrapper(rootPath, rootPath, 0, MS_BIND, 0)) {
+            std::cerr << "Couldn't bind mount new root" << std::endl;
+            return 1;
+        }
+    }
+
+    // Perform mounts specified in the config file
+    for (auto &mnt : subsystem.mntPoints) {
+        std::string tmpPath = mnt.second;
+        if (ba::starts_with(mnt.second.string(), "/")) {
+            tmpPath.erase(0, 1);
+        }
+
+        fs::path mntPoint = rootPath / tmpPath;
+        if (!fs::exists(mntPoint)) {
+            if (fs::is_directory(mnt.first)) {
+                fs::create_directories(mntPoint);
+            } else {
+                createFile(mntPoint);
+            }
+        }
+        if (!mountWrapper(mnt.first, mntPoint, 0, MS_BIND, 0)) {
+            std::cerr << "Failed to bind mount " << mnt.first << " into "
+                      << subsystem.name << std::endl;
+        }
     }
+
+    // Fix permissions of the /run mount
+    for (auto &p : fs::directory_iterator("/run/user")) {
+        fs::path userPath = rootPath / "run/user" / p.path().filename();
+        if (!mountWrapper(p.path(), userPath, 0, MS_BIND, 0)) {
+            std::cout << "Could not bind mount " << p << " onto " << userPath
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    // Mount procfs
+    if (!mountWrapper("", (rootPath / "proc"), "proc", 0, 0)) {
+        std::cout << "Couldn't mount procfs" << std::endl;
+        return 1;
+    }
+
+    // Mount sysfs
+    if (!mountWrapper("", (rootPath / "sys"), "sysfs", 0, 0)) {
+        std::cout << "Couldn't mount sysfs" << std::endl;
+        return 1;
+    }
+
+    // Mount additional virtual filesystem within the /dev directory
+    if (!mountWrapper("", (rootPath / "dev/pts"), "devpts", 0, 0)) {
+        std::cout << "Couldn't mount pts" << std::endl;
+        return 1;
+    }
+
+    if (!mountWrapper("", (rootPath / "dev/shm"), "tmpfs", 0, 0)) {
+        std::cout << "Couldn't mount shm" << std::endl;
+        return 1;
+    }
+
+    if (!mountWrapper("", (rootPath / "dev/mqueue"), "mqueue", 0, 0)) {
+        std::cout << "Couldn't mount mqueue" << std::endl;
+        return 1;
+    }
+
+    if (!mountWrapper("", (rootPath / "dev/hugepages"), "hugetlbfs", 0, 0)) {
+        std::cout << "Couldn't mount hugepages" << std::endl;
+        return 1;
+    }
+
+    // pivot_root into the new root filesystem and put old root into /oldRoot
+    fs::path putOldRoot = rootPath / "oldRoot";
+    if (!fs::exists(putOldRoot)) {
+        fs::create_directory(putOldRoot);
+    }
+    syscall(SYS_pivot_root, rootPath.c_str(), putOldRoot.c_str());
     return 0;
 }
 
+/**
+ * Fill the pool of ephemeral namespaces of a container
+ * (nsMntDir/<container-name>@ephemeral/ns-<n>) up to the configured size.
+ * A slot is reserved by its ns-<n>.claimed file: replenish removes it once
+ * the namespace is ready, lslExecutor creates it again to take the slot.
+ * Claimed namespaces without any process left are discarded.
+ * @param subsystem Container to replenish the pool for
+ * @return true if the pool has been filled, false otherwise
+ */
+bool replenishPool(const SubsystemConfig &subsystem) {
+    fs::path poolDir = nsMntDir / (subsystem.name + "@ephemeral");
+    fs::create_directories(poolDir / "scratch");
+
+    // Serialize concurrent replenish runs (lslExecutor starts one per
+    // invocation)
+    int lockFd = open((poolDir / "lock").c_str(), O_CREAT | O_RDONLY, 0600);
+    if (lockFd == -1 || flock(lockFd, LOCK_EX) != 0) {
+        std::cerr << "Couldn't lock pool of " << subsystem.name << std::endl;
+        return false;
+    }
+
+    // Discard the namespaces of ephemeral invocations that have exited
+    // (lslExecutor holds the lock until it entered the namespace)
+    std::vector<fs::path> claimedSlots;
+    for (auto &p : fs::directory_iterator(poolDir)) {
+        if (p.path().extension() == ".claimed") {
+            claimedSlots.push_back(p.path());
+        }
+    }
+    for (auto &claimed : claimedSlots) {
+        fs::path slotPath = fs::path(claimed).replace_extension();
+        if (isNamespaceMount(slotPath) && namespaceInUse(slotPath)) {
+            continue;
+        }
+        umount2(slotPath.c_str(), MNT_DETACH);
+        fs::remove(slotPath);
+        fs::remove(claimed);
+        debug(boost::format("Discarded %1% of pool of %2%") %
+              slotPath.filename() % subsystem.name);
+    }
+
+    unsigned available = 0;
+    unsigned next = 0;
+    for (auto &p : fs::directory_iterator(poolDir)) {
+        std::string name = p.path().filename().string();
+        if (!ba::starts_with(name, "ns-")) {
+            continue;
+        }
+        unsigned n = std::stoul(name.substr(3));
+        next = std::max(next, n + 1);
+        if (p.path().extension() != ".claimed" &&
+            !fs::exists(p.path().string() + ".claimed")) {
+            available++;
+        }
+    }
+
+    bool ret = true;
+    for (; available < subsystem.ephemeralPoolSize; available++, next++) {
+        std::string slot = "ns-" + std::to_string(next);
+        fs::path claimed = poolDir / (slot + ".claimed");
+        createFile(claimed);
+
+        pid_t child = fork();
+        if (child == 0) {
+            exit(setupNamespace(subsystem,
+                                subsystem.name + "@ephemeral/" + slot,
+                                poolDir / "scratch"));
+        }
+        int status;
+        waitpid(child, &status, 0);
+        fs::path slotPath = poolDir / slot;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+            !isNamespaceMount(slotPath)) {
+            std::cerr << "Couldn't create ephemeral namespace for "
+                      << subsystem.name << std::endl;
+            // Don't leave the slot reserved (or a half set up namespace)
+            // behind
+            umount2(slotPath.c_str(), MNT_DETACH);
+            fs::remove(slotPath);
+            fs::remove(claimed);
+            ret = false;
+            break;
+        }
+        debug(boost::format("Added %1% to pool of %2%") % slot %
+              subsystem.name);
+        fs::remove(claimed);
+    }
+    close(lockFd);
+    return ret;
+}
+
+/**
+ * Remove linksDir including all links within.
+ * @param batch Batch the unlink operations are queued to
+ */
+void removeLinks(LinkBatch &batch) {
+    for (auto &p : fs::directory_iterator(linksDir)) {
+        batch.unlink(p.path());
+    }
+    batch.flush();
+    fs::remove_all(linksDir);
+}
+
+/**
+ * Print the number of link operations and their throughput.
+ */
+void reportLinks(const LinkBatch &batch) {
+    std::cout << boost::format("%1% link operations (%2%, %3$.0f ops/s)") %
+                     batch.completed() %
+                     (batch.usesIoUring() ? "io_uring" : "worker threads") %
+                     batch.opsPerSecond();
+    if (batch.failed()) {
+        std::cout << ", " << batch.failed() << " failed";
+    }
+    std::cout << std::endl;
+}
+
 enum Request : uint_fast8_t {
     START,
     RELINK,
     STOP,
+    REPLENISH,
+    DEDUP,
+    PS,
 };
 
 inline void usage(char *progName,
                   const boost::program_options::options_description &desc) {
     std::cout << "Usage: " << progName
-              << " <start | stop | relink> [options]\n\n";
+              << " <start | stop | relink | replenish | dedup | ps> [options] "
+                 "[container]\n\n";
     std::cout << "Actions:\n";
     std::cout
         << "  start: Start containers (setup namespaces and create symlinks)\n";
     std::cout << "  stop: Stop containers (reomve links and namespaces)\n";
+    std::cout << "  ps: List the processes running in the containers\n";
     std::cout
         << "  relink: Recreate Symlinks (use only when already started)\n";
+    std::cout << "  replenish: Refill the pools of ephemeral namespaces (done "
+                 "by lslExecutor)\n";
+    std::cout << "  dedup: Hardlink identical files of all containers into a "
+                 "shared store\n";
     std::cout << "\n";
     std::cout << desc;
 }
 
-class SeccompWrapper {
-  public:
-    void init() {
-        ctx = seccomp_init(SCMP_ACT_KILL);
-        if (!ctx) {
-            throw std::runtime_error("Couldn't initialize seccomp context");
-        }
-    }
-
-    ~SeccompWrapper() { seccomp_release(ctx); }
-
-    void allowSyscall(int syscall) {
-        if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, syscall, 0) != 0) {
-            throw std::runtime_error("Couldn't add syscall number " +
-                                     std::to_string(syscall) +
-                                     " to seccomp context");
-        }
-    }
-
-    void loadFilter() {
-        if (seccomp_load(ctx) != 0) {
-            throw std::runtime_error("Couldn't load seccomp filter");
-        }
-    }
-
-  private:
-    scmp_filter_ctx ctx;
-};
-
-void seccomp(const std::vector<int> &syscalls) {
-    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
-        throw std::runtime_error("Couldn't set no new privs");
-    }
-    SeccompWrapper ctx;
-    ctx.init();
-    for (auto syscall : syscalls) {
-        ctx.allowSyscall(syscall);
-    }
-    ctx.loadFilter();
-}
+// Syscalls lsl is allowed to perform once the arguments have been parsed. The
+// filter is compiled at build time. Legacy syscalls (and their 32 bit
+// variants) only exist on some architectures.
+constexpr auto lslSeccompFilter = makeSeccompAllowList(std::array{
+    SYS_brk,
+    SYS_clone,
+    SYS_clone3,
+    SYS_close,
+    SYS_exit,
+    SYS_exit_group,
+#ifdef SYS_chmod
+    SYS_chmod,
+#endif
+    SYS_fchmod,
+    SYS_fchmodat,
+    SYS_fcntl,
+#ifdef SYS_fcntl64
+    SYS_fcntl64,
+#endif
+    SYS_flock,
+    SYS_futex,
+#ifdef SYS_getdents
+    SYS_getdents,
+#endif
+    SYS_getdents64,
+    SYS_getppid,
+    SYS_io_uring_enter,
+    SYS_kill,
+    SYS_lseek,
+#ifdef SYS__llseek
+    SYS__llseek,
+#endif
+    SYS_madvise,
+#ifdef SYS_mkdir
+    SYS_mkdir,
+#endif
+    SYS_mkdirat,
+#ifdef SYS_mmap
+    SYS_mmap,
+#endif
+#ifdef SYS_mmap2
+    SYS_mmap2,
+#endif
+    SYS_mount,
+    SYS_mprotect,
+    SYS_munmap,
+    SYS_fstat,
+#ifdef SYS_fstat64
+    SYS_fstat64,
+#endif
+#ifdef SYS_newfstatat
+    SYS_newfstatat,
+#endif
+#ifdef SYS_fstatat64
+    SYS_fstatat64,
+#endif
+    SYS_openat,
+#ifdef SYS_open
+    SYS_open,
+#endif
+    SYS_pidfd_open,
+    SYS_pidfd_send_signal,
+    SYS_pipe2,
+    SYS_pivot_root,
+#ifdef SYS_poll
+    SYS_poll,
+#endif
+    SYS_ppoll,
+    SYS_read,
+    SYS_readv,
+#ifdef SYS_rmdir
+    SYS_rmdir,
+#endif
+    SYS_rseq,
+    SYS_rt_sigaction,
+    SYS_rt_sigprocmask,
+    SYS_sendfile,
+#ifdef SYS_sendfile64
+    SYS_sendfile64,
+#endif
+    SYS_set_robust_list,
+#ifdef SYS_symlink
+    SYS_symlink,
+#endif
+    SYS_symlinkat,
+    SYS_umount2,
+#ifdef SYS_unlink
+    SYS_unlink,
+#endif
+    SYS_unlinkat,
+    SYS_unshare,
+    SYS_wait4,
+    SYS_write,
+    SYS_writev,
+});
+
+// Syscalls of the dedup request (which additionally needs threads and
+// linking of files)
+constexpr auto dedupSeccompFilter = makeSeccompAllowList(std::array{
+    SYS_brk,
+    SYS_clone,
+    SYS_clone3,
+    SYS_close,
+    SYS_exit,
+    SYS_exit_group,
+    SYS_fcntl,
+#ifdef SYS_fcntl64
+    SYS_fcntl64,
+#endif
+    SYS_fgetxattr,
+    SYS_flistxattr,
+    SYS_fstat,
+#ifdef SYS_fstat64
+    SYS_fstat64,
+#endif
+    SYS_futex,
+    SYS_getdents64,
+    SYS_ioctl,
+#ifdef SYS_link
+    SYS_link,
+#endif
+    SYS_linkat,
+    SYS_lseek,
+#ifdef SYS__llseek
+    SYS__llseek,
+#endif
+    SYS_madvise,
+#ifdef SYS_mkdir
+    SYS_mkdir,
+#endif
+    SYS_mkdirat,
+#ifdef SYS_mmap
+    SYS_mmap,
+#endif
+#ifdef SYS_mmap2
+    SYS_mmap2,
+#endif
+    SYS_mprotect,
+    SYS_munmap,
+#ifdef SYS_newfstatat
+    SYS_newfstatat,
+#endif
+#ifdef SYS_fstatat64
+    SYS_fstatat64,
+#endif
+    SYS_openat,
+    SYS_read,
+#ifdef SYS_rename
+    SYS_rename,
+#endif
+#ifdef SYS_renameat
+    SYS_renameat,
+#endif
+    SYS_renameat2,
+    SYS_rseq,
+    SYS_rt_sigaction,
+    SYS_rt_sigprocmask,
+    SYS_set_robust_list,
+#ifdef SYS_unlink
+    SYS_unlink,
+#endif
+    SYS_unlinkat,
+    SYS_utimensat,
+    SYS_write,
+    SYS_writev,
+});
 
 int main(int argc, char **argv) {
-    // CAP_SYS_ADMIN is required to create the namespace(s)
-    dropToCapabilities({CAP_SYS_ADMIN});
     boost::program_options::options_description desc{"Options"};
     desc.add_options()("help,h", "Help screen")(
         "debug,d", "Enable debugging output")("disable-seccomp,s",
-                                              "Disable seccomp filter");
+                                              "Disable seccomp filter")(
+        "store", boost::program_options::value<std::string>(),
+        "Store used by dedup")("incremental,i",
+                               "Dedup: only hash files changed since the last "
+                               "run")(
+        "drain",
+        boost::program_options::value<unsigned>()->implicit_value(10),
+        "Stop: terminate the processes of the containers, kill them after "
+        "the timeout (seconds)")(
+        "queue-depth",
+        boost::program_options::value<unsigned>()->default_value(256),
+        "Number of link operations in flight (io_uring queue depth or "
+        "worker threads)");
+    boost::program_options::options_description hidden;
+    hidden.add_options()("container",
+                         boost::program_options::value<std::string>());
+    boost::program_options::options_description all;
+    all.add(desc).add(hidden);
+    boost::program_options::positional_options_description positional;
+    positional.add("container", 1);
 
     if (argc < 2) {
         usage(argv[0], desc);
@@ -188,7 +704,7 @@ int main(int argc, char **argv) {
     }
 
     boost::program_options::command_line_parser parser{argc - 1, argv + 1};
-    parser.options(desc);
+    parser.options(all).positional(positional);
     boost::program_options::parsed_options parsed_options = parser.run();
 
     boost::program_options::variables_map vm;
@@ -207,52 +723,66 @@ int main(int argc, char **argv) {
         request = Request::RELINK;
     } else if (strcmp(argv[1], "stop") == 0) {
         request = Request::STOP;
+    } else if (strcmp(argv[1], "replenish") == 0) {
+        request = Request::REPLENISH;
+    } else if (strcmp(argv[1], "dedup") == 0) {
+        request = Request::DEDUP;
+    } else if (strcmp(argv[1], "ps") == 0) {
+        request = Request::PS;
     } else {
         usage(argv[0], desc);
         return 1;
     }
 
+    if (request == Request::DEDUP) {
+        // Reading and linking files of all users of the containers requires to
+        // bypass permission checks
+        dropToCapabilities(
+            {CAP_DAC_OVERRIDE, CAP_DAC_READ_SEARCH, CAP_FOWNER});
+    } else if (request == Request::PS || request == Request::STOP) {
+        // CAP_SYS_PTRACE is required to inspect the mount namespaces of
+        // processes of other users and CAP_KILL to drain them
+        dropToCapabilities({CAP_SYS_ADMIN, CAP_SYS_PTRACE, CAP_KILL});
+    } else {
+        // CAP_SYS_ADMIN is required to create the namespace(s). overlayfs
+        // performs copy-up and whiteouts in the writable layer of ephemeral
+        // namespaces with the credentials of the mounting process.
+        std::vector<cap_value_t> caps{CAP_SYS_ADMIN, CAP_DAC_OVERRIDE,
+                                      CAP_CHOWN,     CAP_FOWNER,
+                                      CAP_FSETID,    CAP_MKNOD};
+        if (request == Request::REPLENISH) {
+            // Claimed namespaces are only discarded once no process (of any
+            // user) is left in them
+            caps.push_back(CAP_SYS_PTRACE);
+        }
+        dropToCapabilities(caps);
+    }
+
     if (vm.count("debug")) {
         DEBUG = true;
     }
+
+    // The io_uring instance of the link operations has to be set up before
+    // the seccomp filter is loaded, which doesn't permit to create new
+    // (unrestricted) instances
+    std::optional<LinkBatch> batch;
+    if (request == Request::START || request == Request::RELINK ||
+        request == Request::STOP) {
+        batch.emplace(vm["queue-depth"].as<unsigned>());
+    }
+
     if (vm.count("disable-seccomp") == 0) {
-        seccomp({
-            SCMP_SYS(brk),
-            SCMP_SYS(clone),
-            SCMP_SYS(clone3),
-            SCMP_SYS(close),
-            SCMP_SYS(exit),
-            SCMP_SYS(exit_group),
-            SCMP_SYS(chmod),
-            SCMP_SYS(fchmod),
-            SCMP_SYS(fchmodat),
-            SCMP_SYS(fcntl),
-            SCMP_SYS(getdents),
-            SCMP_SYS(getdents64),
-            SCMP_SYS(getppid),
-            SCMP_SYS(mkdir),
-            SCMP_SYS(mkdirat),
-            SCMP_SYS(mount),
-            SCMP_SYS(fstat),
-            SCMP_SYS(newfstatat),
-            SCMP_SYS(openat),
-            SCMP_SYS(open),
-            SCMP_SYS(pivot_root),
-            SCMP_SYS(read),
-            SCMP_SYS(readv),
-            SCMP_SYS(rmdir),
-            SCMP_SYS(sendfile),
-            SCMP_SYS(set_robust_list),
-            SCMP_SYS(symlink),
-            SCMP_SYS(symlinkat),
-            SCMP_SYS(umount2),
-            SCMP_SYS(unlink),
-            SCMP_SYS(unlinkat),
-            SCMP_SYS(unshare),
-            SCMP_SYS(wait4),
-            SCMP_SYS(write),
-            SCMP_SYS(writev),
-        });
+        // glibc checks if stdout is a terminal (ioctl) once it allocates the
+        // buffer of stdout, which the filter doesn't permit. Provide the
+        // buffer before.
+        static char stdoutBuffer[BUFSIZ];
+        setvbuf(stdout, stdoutBuffer, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF,
+                sizeof(stdoutBuffer));
+        if (request == Request::DEDUP) {
+            dedupSeccompFilter.load();
+        } else {
+            lslSeccompFilter.load();
+        }
     }
 
     // Handle start or relink request
@@ -272,60 +802,7 @@ int main(int argc, char **argv) {
         }
 
         // Parse config file
-        bpt::ptree pt;
-        bpt::ini_parser::read_ini(config, pt);
-        std::vector<SubsystemConfig> subsystems;
-        for (auto &section : pt) {
-
-            const std::string &name = section.first;
-            fs::path path;
-            std::vector<std::pair<fs::path, fs::path>> mntPoints;
-            std::vector<fs::path> bins;
-            std::optional<fs::path> interpreter;
-
-            // Mount /dev and /run by default
-            mntPoints.emplace_back("/dev", "/dev");
-            mntPoints.emplace_back("/run", "/run");
-
-            for (auto &option : section.second) {
-                if (option.first == "path") {
-                    path = option.second.get_value<fs::path>();
-                    if (!fs::exists(path) || !fs::is_directory(path)) {
-                        std::cerr << path
-                                  << " is not a path to a directory. Ignoring "
-                                  << name << std::endl;
-                        continue;
-                    }
-                } else if (option.first == "mnt") {
-                    std::string v = option.second.get_value<std::string>();
-                    std::vector<std::string> mntPointsTemp;
-                    ba::split(mntPointsTemp, v, boost::is_any_of(";"));
-                    for (auto &mntPoint : mntPointsTemp) {
-                        std::vector<fs::path> mntPaths;
-                        ba::split(mntPaths, mntPoint, boost::is_any_of(":"));
-                        std::pair<fs::path, fs::path> mntInfo;
-                        if (mntPaths.size() > 1) {
-                            mntInfo = {mntPaths[0], mntPaths[1]};
-                        } else {
-                            mntInfo = {mntPaths[0], mntPaths[0]};
-                        }
-                        if (!fs::exists(mntPaths[0])) {
-                            std::cerr << "File " << mntPaths[0]
-                                      << "couldn't be found. Ignoring mount..."
-                                      << std::endl;
-                            continue;
-                        }
-                        mntPoints.push_back(mntInfo);
-                    }
-                } else if (option.first == "bins") {
-                    std::string v = option.second.get_value<std::string>();
-                    ba::split(bins, v, boost::is_any_of(";"));
-                } else if (option.first == "interpreter") {
-                    interpreter = option.second.get_value<std::string>();
-                }
-            }
-            subsystems.emplace_back(name, path, mntPoints, bins, interpreter);
-        }
+        std::vector<SubsystemConfig> subsystems = parseConfig();
 
         // If start request --> mount namespace and appropriate mounts need to
         // be performed.
@@ -371,132 +848,21 @@ int main(int argc, char **argv) {
                 // mount namespace
                 pid_t child = fork();
                 if (child == 0) {
-                    // Create mount namespace and bind mount it to keep it alive
-                    // after the child exits.
-                    char *stk = new char[1024*1024];
-                    {
-                        std::mutex mtx;
-                        const std::lock_guard<std::mutex> lock(mtx);
-                        auto data = std::make_pair(subsystem.name, &mtx);
-                        // Use clone directly to create a child process with
-                        // different pid but same virtual memory
-                        clone(childBindMountNamespace, stk + 1024*1024,
-                              CLONE_VM | CLONE_CHILD_CLEARTID | SIGCHLD, &(data));
-                        if (unshare(CLONE_NEWNS) != 0) {
-                            std::cerr << "Couldn't create mount namespace: "
-                                      << strerror(errno) << ". Exiting..."
-                                      << std::endl;
-                            return 1;
-                        }
-                    }
-                    wait(NULL);
-
-                    // Configure all mount points of the new mount namespace as
-                    // slaves to not propagate the following mounts
-                    if (!mountWrapper("", "/", 0, MS_SLAVE | MS_REC, 0)) {
-                        std::cerr << "Couldn't set root mount as slave"
-                                  << std::endl;
-                        return 1;
-                    }
-
-                    // Bind mount the directory containing the new root
-                    // filesystem to itself to enable usage of pivot_root
-                    if (!mountWrapper(subsystem.path, subsystem.path, 0,
-                                      MS_BIND, 0)) {
-                        std::cerr << "Couldn't bind mount new root"
-                                  << std::endl;
-                        return 1;
-                    }
-
-                    // Perform mounts specified in the config file
-                    for (auto &mnt : subsystem.mntPoints) {
-                        std::string tmpPath = mnt.second;
-                        if (ba::starts_with(mnt.second.string(), "/")) {
-                            tmpPath.erase(0, 1);
-                        }
-
-                        fs::path mntPoint = subsystem.path / tmpPath;
-                        if (!fs::exists(mntPoint)) {
-                            if (fs::is_directory(mnt.first)) {
-                                fs::create_directories(mntPoint);
-                            } else {
-                                createFile(mntPoint);
-                            }
-                        }
-                        if (!mountWrapper(mnt.first, mntPoint, 0, MS_BIND, 0)) {
-                            std::cerr << "Failed to bind mount " << mnt.first
-                                      << " into " << subsystem.name
-                                      << std::endl;
-                        }
-                    }
-
-                    // Fix permissions of the /run mount
-                    for (auto &p : fs::directory_iterator("/run/user")) {
-                        fs::path userPath =
-                            subsystem.path / "run/user" / p.path().filename();
-                        if (!mountWrapper(p.path(), userPath, 0, MS_BIND, 0)) {
-                            std::cout << "Could not bind mount " << p
-                                      << " onto " << userPath << std::endl;
-                            return 1;
-                        }
-                    }
-
-                    // Mount procfs
-                    if (!mountWrapper("", (subsystem.path / "proc"), "proc", 0,
-                                      0)) {
-                        std::cout << "Couldn't mount procfs" << std::endl;
-                        return 1;
-                    }
-
-                    // Mount sysfs
-                    if (!mountWrapper("", (subsystem.path / "sys"), "sysfs", 0,
-                                      0)) {
-                        std::cout << "Couldn't mount sysfs" << std::endl;
-                        return 1;
-                    }
-
-                    // Mount additional virtual filesystem within the /dev
-                    // directory
-                    if (!mountWrapper("", (subsystem.path / "dev/pts"),
-                                      "devpts", 0, 0)) {
-                        std::cout << "Couldn't mount pts" << std::endl;
-                        return 1;
-                    }
-
-                    if (!mountWrapper("", (subsystem.path / "dev/shm"), "tmpfs",
-                                      0, 0)) {
-                        std::cout << "Couldn't mount shm" << std::endl;
-                        return 1;
-                    }
-
-                    if (!mountWrapper("", (subsystem.path / "dev/mqueue"),
-                                      "mqueue", 0, 0)) {
-                        std::cout << "Couldn't mount mqueue" << std::endl;
-                        return 1;
-                    }
-
-                    if (!mountWrapper("", (subsystem.path / "dev/hugepages"),
-                                      "hugetlbfs", 0, 0)) {
-                        std::cout << "Couldn't mount hugepages" << std::endl;
-                        return 1;
-                    }
-
-                    // pivot_root into the new root filesystem and put old root
-                    // into /oldRoot
-                    fs::path putOldRoot = subsystem.path / "oldRoot";
-                    if (!fs::exists(putOldRoot)) {
-                        fs::create_directory(putOldRoot);
-                    }
-                    syscall(SYS_pivot_root, subsystem.path.c_str(),
-                            putOldRoot.c_str());
-                    return 0;
+                    return setupNamespace(subsystem, subsystem.name,
+                                          std::nullopt);
                 }
                 wait(NULL);
+
+                // Pre-create the namespaces handed out to ephemeral
+                // invocations
+                if (subsystem.ephemeralPoolSize > 0) {
+                    replenishPool(subsystem);
+                }
             }
         }
 
         if (fs::is_directory(linksDir))
-            fs::remove_all(linksDir);
+            removeLinks(*batch);
         fs::create_directory(linksDir);
 
         // Create links to executables of the containers
@@ -514,29 +880,112 @@ int main(int argc, char **argv) {
                 // contained files
                 if (fs::is_directory(absBinPath)) {
                     for (auto &path : fs::directory_iterator(absBinPath)) {
-                        fs::path linkName =
-                            linksDir / (subsystem.name + ":" +
-                                        path.path().filename().string());
-                        if (!fs::is_symlink(linkName)) {
-                            fs::create_symlink(executorPath, linkName);
-                        }
+                        batch->symlink(executorPath,
+                                      linksDir /
+                                          (subsystem.name + ":" +
+                                           path.path().filename().string()));
                     }
                 } else {
-                    fs::path linkName =
-                        linksDir /
-                        (subsystem.name + ":" + binPath.filename().string());
-                    if (!fs::is_symlink(linkName)) {
-                        fs::create_symlink(executorPath, linkName);
-                    }
+                    batch->symlink(executorPath,
+                                  linksDir / (subsystem.name + ":" +
+                                              binPath.filename().string()));
                 }
             }
         }
+        batch->flush();
+        reportLinks(*batch);
+    }
+    // Handle replenish request --> refill the pools of ephemeral namespaces
+    else if (request == Request::REPLENISH) {
+        if (!fs::exists(nsMntDir)) {
+            std::cerr << "Subsystem seems not to be running." << std::endl;
+            return 1;
+        }
+
+        bool ret = true;
+        for (auto &subsystem : parseConfig()) {
+            if (subsystem.ephemeralPoolSize == 0 ||
+                (vm.count("container") &&
+                 vm["container"].as<std::string>() != subsystem.name)) {
+                continue;
+            }
+            ret &= replenishPool(subsystem);
+        }
+        return ret ? 0 : 1;
+    }
+    // Handle dedup request --> link identical files of all containers into the
+    // store
+    else if (request == Request::DEDUP) {
+        if (!fs::exists(config) || !fs::is_regular_file(config)) {
+            std::cerr << "Couldn't find config file at " << config
+                      << ". Exiting..." << std::endl;
+            return 1;
+        }
+
+        std::vector<fs::path> roots;
+        for (auto &subsystem : parseConfig()) {
+            if (!subsystem.path.empty() && fs::is_directory(subsystem.path)) {
+                roots.push_back(subsystem.path);
+            }
+        }
+        fs::path store = dedupDir;
+        if (vm.count("store")) {
+            store = vm["store"].as<std::string>();
+        }
+
+        DedupStats stats = dedup(roots, store, vm.count("incremental") > 0);
+        std::cout << stats.files << " files, " << stats.hashed << " hashed, "
+                  << stats.linked << " hardlinked, " << stats.reflinked
+                  << " reflinked, " << stats.skipped << " skipped, "
+                  << stats.pruned << " pruned from store" << std::endl;
+        std::cout << "Saved " << stats.savedBytes << " bytes" << std::endl;
+    }
+    // Handle ps request --> list processes per container
+    else if (request == Request::PS) {
+        std::optional<std::string> container;
+        if (vm.count("container")) {
+            container = vm["container"].as<std::string>();
+        }
+
+        std::string current;
+        for (auto &proc : findContainerProcesses(container)) {
+            if (proc.container != current) {
+                current = proc.container;
+                std::cout << current << ":\n";
+                std::cout << boost::format("%1$8s %2$10s %3$10s  %4%\n") %
+                                 "PID" % "RSS(KiB)" % "CPU(s)" % "COMMAND";
+            }
+            std::cout << boost::format("%1$8d %2$10d %3$10.2f  %4%\n") %
+                             proc.pid % (proc.rss / 1024) % proc.cpuTime %
+                             proc.comm;
+        }
     }
     // Handle stop request --> remove bind mounts of mount namespaces and remove
     // all links
     else if (request == Request::STOP) {
+        // Terminate the processes first, otherwise they keep the namespaces
+        // alive
+        if (vm.count("drain") &&
+            !drainContainerProcesses(vm["drain"].as<unsigned>())) {
+            std::cerr << "Couldn't terminate all processes of the containers"
+                      << std::endl;
+        }
         if (fs::exists(nsMntDir)) {
             for (auto &p : fs::directory_iterator(nsMntDir)) {
+                // Pools of ephemeral namespaces
+                if (fs::is_directory(p.path())) {
+                    for (auto &slot : fs::directory_iterator(p.path())) {
+                        std::string name = slot.path().filename().string();
+                        if (ba::starts_with(name, "ns-") &&
+                            slot.path().extension() != ".claimed" &&
+                            umount2(slot.path().c_str(), 0) != 0) {
+                            std::cerr << "Couldn't unmount " << slot
+                                      << ". Manual unmount required?"
+                                      << std::endl;
+                        }
+                    }
+                    continue;
+                }
                 if (umount2(p.path().c_str(), 0) != 0) {
                     std::cerr << "Couldn't unmount " << p
                               << ". Manual unmount required?" << std::endl;
@@ -547,7 +996,10 @@ int main(int argc, char **argv) {
             }
             fs::remove_all(nsMntDir);
         }
-        fs::remove_all(linksDir);
+        if (fs::is_directory(linksDir)) {
+            removeLinks(*batch);
+            reportLinks(*batch);
+        }
     }
 
     return 0;
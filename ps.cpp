@@ -0,0 +1,260 @@
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <tuple>
+
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ps.h"
+
+namespace {
+
+using NamespaceId = std::pair<dev_t, ino_t>;
+
+/**
+ * @return Mount namespaces bind mounted to nsMntDir and the containers they
+ * belong to. Namespaces of the pools of ephemeral namespaces are included,
+ * claimed ones stay bind mounted while the invocation runs.
+ */
+std::map<NamespaceId, std::string> containerNamespaces() {
+    std::map<NamespaceId, std::string> namespaces;
+    if (!fs::is_directory(nsMntDir)) {
+        return namespaces;
+    }
+
+    struct stat st;
+    for (auto &p : fs::directory_iterator(nsMntDir)) {
+        std::string name = p.path().filename().string();
+        if (fs::is_directory(p.path())) {
+            for (auto &slot : fs::directory_iterator(p.path())) {
+                if (slot.path().filename().string().rfind("ns-", 0) == 0 &&
+                    slot.path().extension() != ".claimed" &&
+                    stat(slot.path().c_str(), &st) == 0) {
+                    namespaces[{st.st_dev, st.st_ino}] = name;
+                }
+            }
+        } else if (stat(p.path().c_str(), &st) == 0) {
+            namespaces[{st.st_dev, st.st_ino}] = name;
+        }
+    }
+    return namespaces;
+}
+
+std::optional<NamespaceId> namespaceOf(pid_t pid) {
+    struct stat st;
+    fs::path ns = fs::path("/proc") / std::to_string(pid) / "ns/mnt";
+    if (stat(ns.c_str(), &st) != 0) {
+        return std::nullopt;
+    }
+    return NamespaceId{st.st_dev, st.st_ino};
+}
+
+/**
+ * Read command name and CPU time (/proc/<pid>/stat) as well as the resident
+ * set size (/proc/<pid>/statm) of a process.
+ * @return false if the process exited in the meantime
+ */
+bool readProcessInfo(ContainerProcess &proc) {
+    fs::path procDir = fs::path("/proc") / std::to_string(proc.pid);
+
+    std::ifstream statFile(procDir / "stat");
+    std::string stat;
+    if (!std::getline(statFile, stat)) {
+        return false;
+    }
+    // The command name may contain spaces and parentheses
+    auto commStart = stat.find('(');
+    auto commEnd = stat.rfind(')');
+    if (commStart == std::string::npos || commEnd == std::string::npos) {
+        return false;
+    }
+    proc.comm = stat.substr(commStart + 1, commEnd - commStart - 1);
+
+    // Fields after the command name, starting with the state (field 3)
+    std::istringstream fields(stat.substr(commEnd + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i == 14) {
+            utime = std::stoul(field);
+        } else if (i == 15) {
+            stime = std::stoul(field);
+        }
+    }
+    proc.cpuTime = static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+
+    std::ifstream statmFile(procDir / "statm");
+    uintmax_t size, resident;
+    if (!(statmFile >> size >> resident)) {
+        return false;
+    }
+    proc.rss = resident * sysconf(_SC_PAGESIZE);
+    return true;
+}
+
+/**
+ * Send sig to all processes of the containers and wait until they exited.
+ * Processes that are created in the meantime are signaled as well.
+ * @param deadline Point in time to stop waiting at
+ * @return true if no process is left, false otherwise
+ */
+bool signalAndWait(int sig, std::chrono::steady_clock::time_point deadline) {
+    auto namespaces = containerNamespaces();
+
+    // Signaled processes, -1 if no pidfd could be opened
+    std::map<pid_t, int> pidfds;
+    bool ret = false;
+    while (true) {
+        auto procs = findContainerProcesses(std::nullopt);
+        if (procs.empty()) {
+            ret = true;
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+
+        bool polling = false;
+        for (auto &proc : procs) {
+            if (pidfds.count(proc.pid)) {
+                polling |= pidfds[proc.pid] == -1;
+                continue;
+            }
+            int fd = syscall(SYS_pidfd_open, proc.pid, 0);
+
+            // The pid might have been reused since the scan of /proc
+            auto ns = namespaceOf(proc.pid);
+            if (!ns || !namespaces.count(*ns)) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                continue;
+            }
+
+            debug(boost::format("Sending signal %1% to %2% (%3%) in %4%") %
+                  sig % proc.pid % proc.comm % proc.container);
+            if (fd != -1) {
+                syscall(SYS_pidfd_send_signal, fd, sig, NULL, 0);
+            } else {
+                // Kernel without pidfd support
+                kill(proc.pid, sig);
+                polling = true;
+            }
+            pidfds[proc.pid] = fd;
+        }
+
+        // Wait for any of the processes to exit. Wake up regularly to catch
+        // new processes (and processes without pidfd).
+        std::vector<pollfd> fds;
+        for (auto &[pid, fd] : pidfds) {
+            if (fd != -1) {
+                fds.push_back({fd, POLLIN, 0});
+            }
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        int timeout =
+            std::clamp<long>(remaining.count(), 0, polling ? 50 : 250);
+        poll(fds.data(), fds.size(), timeout);
+
+        // Forget exited processes, their pids may be reused
+        for (auto it = pidfds.begin(); it != pidfds.end();) {
+            auto fd = std::find_if(fds.begin(), fds.end(), [&](auto &pfd) {
+                return pfd.fd == it->second;
+            });
+            if (fd != fds.end() && fd->revents) {
+                close(it->second);
+                it = pidfds.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (auto &[pid, fd] : pidfds) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    return ret;
+}
+
+} // namespace
+
+std::vector<ContainerProcess>
+findContainerProcesses(const std::optional<std::string> &container) {
+    std::vector<ContainerProcess> procs;
+    auto namespaces = containerNamespaces();
+    if (namespaces.empty()) {
+        return procs;
+    }
+
+    for (auto &p : fs::directory_iterator("/proc")) {
+        std::string name = p.path().filename().string();
+        if (name.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+        pid_t pid = std::stoi(name);
+        auto ns = namespaceOf(pid);
+        if (!ns) {
+            continue;
+        }
+        auto it = namespaces.find(*ns);
+        if (it == namespaces.end()) {
+            continue;
+        }
+
+        ContainerProcess proc{pid, it->second, "", 0, 0};
+        if (container && proc.container != *container &&
+            proc.container != *container + "@ephemeral") {
+            continue;
+        }
+        if (readProcessInfo(proc)) {
+            procs.push_back(proc);
+        }
+    }
+
+    std::sort(procs.begin(), procs.end(), [](auto &a, auto &b) {
+        return std::tie(a.container, a.pid) < std::tie(b.container, b.pid);
+    });
+    return procs;
+}
+
+bool namespaceInUse(const fs::path &nsFile) {
+    struct stat st;
+    if (stat(nsFile.c_str(), &st) != 0) {
+        return false;
+    }
+    for (auto &p : fs::directory_iterator("/proc")) {
+        std::string name = p.path().filename().string();
+        if (name.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+        auto ns = namespaceOf(std::stoi(name));
+        if (ns && *ns == NamespaceId{st.st_dev, st.st_ino}) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool drainContainerProcesses(unsigned timeout) {
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    if (signalAndWait(SIGTERM, deadline)) {
+        return true;
+    }
+    std::cerr << "Processes didn't exit within " << timeout
+              << "s, killing them" << std::endl;
+    return signalAndWait(SIGKILL, std::chrono::steady_clock::now() +
+                                      std::chrono::seconds(1));
+}
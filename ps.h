@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "common.h"
+
+/**
+ * Process running within the mount namespace of a container
+ */
+struct ContainerProcess {
+    pid_t pid;
+    std::string container;
+    std::string comm;
+    uintmax_t rss;  // Resident set size in bytes
+    double cpuTime; // User and system time in seconds
+};
+
+/**
+ * Find the processes of the containers with a single pass over /proc by
+ * matching the mount namespace of each process against the namespace files
+ * in nsMntDir.
+ * @param container Only return the processes of this container
+ * @return Processes ordered by container and pid
+ */
+std::vector<ContainerProcess>
+findContainerProcesses(const std::optional<std::string> &container);
+
+/**
+ * Check whether any process is running within a mount namespace. Like
+ * findContainerProcesses, processes that can't be inspected are ignored.
+ * @param nsFile File the namespace is bind mounted to
+ * @return true if a process is within the namespace, false otherwise
+ */
+bool namespaceInUse(const fs::path &nsFile);
+
+/**
+ * Terminate all processes of the containers. Processes are sent SIGTERM and
+ * waited for (using pidfds) until the timeout expires, remaining processes
+ * are killed.
+ * @param timeout Seconds to wait for the processes to exit after SIGTERM
+ * @return true if all processes have exited, false otherwise
+ */
+bool drainContainerProcesses(unsigned timeout);
@@ -0,0 +1,120 @@
+#!/bin/sh
+# Start a container with a pool of ephemeral namespaces and run a binary in
+# one of them.
+# Usage: ephemeral_pool.sh <lsl> <lslExecutor> <config> <mntdir> <linksdir>
+# Requires root and an unused lsl setup (config, mntdir and linksdir must not
+# exist), the test is skipped otherwise.
+set -u
+
+lsl=$1
+executor=$2
+config=$3
+mntdir=$4
+linksdir=$5
+
+if [ "$(id -u)" -ne 0 ] || [ -e "$config" ] || [ -e "$mntdir" ] ||
+    [ -e "$linksdir" ]; then
+    echo "Skipping: requires root and no existing lsl setup"
+    exit 77
+fi
+
+work=$(mktemp -d)
+cleanup() {
+    "$lsl" stop >/dev/null 2>&1
+    rm -f "$config"
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# Number of namespaces in the pool that are ready to be claimed
+available() {
+    n=0
+    for slot in "$pool"/ns-*; do
+        case $slot in
+        *.claimed) continue ;;
+        esac
+        if [ ! -e "$slot.claimed" ] &&
+            [ "$(stat -c %d "$slot")" = "$(stat -L -c %d /proc/self/ns/mnt)" ]; then
+            n=$((n + 1))
+        fi
+    done
+    echo $n
+}
+
+# Minimal root filesystem containing sh, rm and the libraries they need
+root=$work/root
+mkdir -p "$root/bin" "$root/dev" "$root/run" "$root/proc" "$root/sys"
+for bin in /bin/sh /bin/rm; do
+    cp "$bin" "$root$bin"
+    for lib in $(ldd "$bin" | grep -o '/[^ ]*'); do
+        mkdir -p "$root$(dirname "$lib")"
+        cp "$lib" "$root$lib"
+    done
+done
+# Files of another user, modifying them in an ephemeral namespace requires a
+# copy-up or whiteout by overlayfs
+mkdir -m 0777 "$root/shared"
+echo lower >"$root/shared/modified"
+echo lower >"$root/shared/removed"
+chmod 0666 "$root/shared/modified" "$root/shared/removed"
+chown -R 65534:65534 "$root/shared"
+
+cat >"$config" <<CONF
+[test]
+path=$root
+bins=/bin
+ephemeral=2
+CONF
+pool=$mntdir/test@ephemeral
+
+"$lsl" start || fail "lsl start"
+[ "$(available)" -eq 2 ] || fail "pool not filled by lsl start"
+
+out=$("$executor" --ephemeral test sh -c \
+    'echo ephemeral >/written && read x </written && echo "$x"') ||
+    fail "lslExecutor --ephemeral"
+echo "$out" | grep -q '^ephemeral$' || fail "unexpected output: $out"
+[ ! -e "$root/written" ] || fail "write to ephemeral namespace persisted"
+
+# A single argument after the container
+echo 'exit 0' | "$executor" --ephemeral test sh >/dev/null ||
+    fail "lslExecutor --ephemeral without arguments"
+
+"$lsl" replenish test || fail "lsl replenish"
+[ "$(available)" -eq 2 ] || fail "pool not refilled by lsl replenish"
+for claimed in "$pool"/*.claimed; do
+    [ ! -e "$claimed" ] || fail "$claimed not discarded by lsl replenish"
+done
+
+"$executor" --ephemeral test sh -c \
+    'echo upper >>/shared/modified && rm /shared/removed' >/dev/null ||
+    fail "modifying files of another user in an ephemeral namespace"
+[ "$(cat "$root/shared/modified")" = lower ] && [ -e "$root/shared/removed" ] ||
+    fail "modification of files in ephemeral namespace persisted"
+
+# A running ephemeral invocation is listed by lsl ps, kept by lsl replenish
+# and terminated by lsl stop --drain
+mkfifo "$work/fifo"
+"$executor" --ephemeral test sh -c 'read x' <"$work/fifo" >/dev/null &
+job=$!
+exec 3>"$work/fifo"
+listed() {
+    for i in $(seq 50); do
+        "$lsl" ps test | grep -q '^test@ephemeral:' && return 0
+        sleep 0.1
+    done
+    return 1
+}
+listed || fail "ephemeral invocation not listed by lsl ps"
+"$lsl" replenish test || fail "lsl replenish"
+listed || fail "namespace of running invocation discarded by lsl replenish"
+
+"$lsl" stop --drain=1 || fail "lsl stop"
+wait $job
+exec 3>&-
+[ ! -e "$mntdir" ] || fail "$mntdir left behind by lsl stop"